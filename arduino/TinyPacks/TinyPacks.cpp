@@ -20,59 +20,130 @@
 
 #include "TinyPacks.h"
 
+static uint8_t tp_parse_header(uint8_t * element, tp_length_t available, tp_length_t * content_length)
+{
+    uint8_t header_length;
+
+    if(available < 1)
+        return 0;
+    if((element[0] & TP_SMALL_SIZE_MASK) != TP_EXTENDED_SIZE_16) {
+        *content_length = element[0] & TP_SMALL_SIZE_MASK;
+        header_length = 1;
+    }
+    else {
+        #if TP_PACK_SIZE == TP_MEDIUM_PACK ||  TP_PACK_SIZE == TP_BIG_PACK
+        if(available < 3)
+            return 0;
+        *content_length = (tp_length_t)( \
+            element[1] << 8 | \
+            element[2] << 0 );
+        header_length = 3;
+        if(*content_length == TP_EXTENDED_SIZE_32) {
+            #if TP_PACK_SIZE == TP_BIG_PACK
+            if(available < 7)
+                return 0;
+            *content_length = (tp_length_t)( \
+                (tp_length_t) element[3] << 24 | \
+                (tp_length_t) element[4] << 16 | \
+                (tp_length_t) element[5] <<  8 | \
+                (tp_length_t) element[6] <<  0 );
+            header_length = 7;
+            #else
+            return 0;
+            #endif
+        }
+        #else
+        return 0;
+        #endif
+    }
+    return *content_length <= available - header_length ? header_length : 0;
+}
+
 PackReader::PackReader(uint8_t * buffer, tp_length_t length)
 {
+#ifdef TP_USE_DICTIONARY
+    setDictionary(NULL, 0);
+#endif
     setBuffer(buffer, length);
 }
 
 void PackReader::setBuffer(uint8_t * buffer, tp_length_t length)
 {
-    cursor = &levels[0];
-    cursor->element_start = buffer;
-    cursor->element_length = 0;
-    cursor->parent_start = buffer;
-    cursor->parent_length = length;
+    this->buffer = buffer;
+    buffer_length = length;
+    depth = 0;
+    levels[0].element_offset = 0;
+    levels[0].content_length = 0;
+    levels[0].header_length = 0;
+#ifdef TP_USE_DICTIONARY
+    inline_dictionary = 0;
+    inline_dictionary_length = 0;
+#endif
 }
 
 bool PackReader::next()
 {
+#ifdef TP_USE_DICTIONARY
+    uint8_t header_length;
+
+    // Dictionary elements are consumed here and never seen by the caller
+    while(step()) {
+        if(getType() != TP_NONE || contentLength() <= 2)
+            return true;
+        header_length = tp_parse_header(contentStart(), contentLength(), &inline_dictionary_length);
+        if(header_length && (contentStart()[0] & TP_TYPE_MASK) == TP_LIST)
+            inline_dictionary = contentStart() + header_length - buffer;
+        else {
+            inline_dictionary = 0;
+            inline_dictionary_length = 0;
+        }
+    }
+    return false;
+#else
+    return step();
+#endif
+}
+
+bool PackReader::step()
+{
+    struct level * cursor = &levels[depth];
+    uint8_t * element;
+
     if(hasNext()) {
-        cursor->element_start +=  cursor->element_length;
-        if((cursor->element_start[0] & TP_SMALL_SIZE_MASK) != TP_EXTENDED_SIZE_16) {
-            cursor->content_length = cursor->element_start[0] & TP_SMALL_SIZE_MASK;
-            cursor->content_start = cursor->element_start + 1;
-            cursor->element_length = cursor->content_length + 1;
+        cursor->element_offset += elementLength();
+        element = elementStart();
+        if((element[0] & TP_SMALL_SIZE_MASK) != TP_EXTENDED_SIZE_16) {
+            cursor->content_length = element[0] & TP_SMALL_SIZE_MASK;
+            cursor->header_length = 1;
             return true;
         }
         else {
             #if TP_PACK_SIZE == TP_MEDIUM_PACK ||  TP_PACK_SIZE == TP_BIG_PACK
             cursor->content_length = (tp_length_t)( \
-                cursor->element_start[1] << 8 | \
-                cursor->element_start[2] << 0 );
+                element[1] << 8 | \
+                element[2] << 0 );
             if(cursor->content_length != TP_EXTENDED_SIZE_32) {
-                cursor->content_start = cursor->element_start + 3;
-                cursor->element_length = cursor->content_length + 3;
+                cursor->header_length = 3;
                 return true;
             }
             else {
                 #if TP_PACK_SIZE == TP_BIG_PACK
                 cursor->content_length = (tp_length_t)( \
-                    cursor->element_start[3] << 24 | \
-                    cursor->element_start[4] << 16 | \
-                    cursor->element_start[5] <<  8 | \
-                    cursor->element_start[6] <<  0 );
-                cursor->content_start = cursor->element_start + 7;
-                cursor->element_length = cursor->content_length + 7;
+                    element[3] << 24 | \
+                    element[4] << 16 | \
+                    element[5] <<  8 | \
+                    element[6] <<  0 );
+                cursor->header_length = 7;
                 return true;
                 #else
-                cursor->element_length = 0;
-                cursor->parent_length = 0;        // make hasNext returns false
+                cursor->header_length = 0;
+                cursor->content_length = parentEnd() - cursor->element_offset;    // make hasNext returns false
                 return false;
                 #endif
             }
             #else
-            cursor->element_length = 0;
-            cursor->parent_length = 0;        // make hasNext returns false
+            cursor->header_length = 0;
+            cursor->content_length = parentEnd() - cursor->element_offset;        // make hasNext returns false
             return false;
             #endif
         }
@@ -83,12 +154,12 @@ bool PackReader::next()
    
 bool PackReader::open() 
 {
-    if(isContainer() && cursor->content_length != 0 && cursor < &levels[TP_MAX_LEVELS - 1]) {
-        (cursor+1)->element_start = cursor->element_start;
-        (cursor+1)->element_length = cursor->content_start - cursor->element_start;
-        (cursor+1)->parent_start = cursor->content_start;
-        (cursor+1)->parent_length = cursor->content_length;    
-        cursor++;
+    if(isContainer() && contentLength() != 0 && depth < TP_MAX_LEVELS - 1) {
+        // The new level starts positioned on the header of the container
+        levels[depth + 1].element_offset = levels[depth].element_offset;
+        levels[depth + 1].header_length = levels[depth].header_length;
+        levels[depth + 1].content_length = 0;
+        depth++;
         return true;
     }
     else
@@ -97,8 +168,19 @@ bool PackReader::open()
 
 bool PackReader::equals(char *string)
 {
-    return isString() && cursor->content_length == strlen(string) && \
-        strncmp(string, (char *)cursor->content_start, cursor->content_length) == 0;
+#ifdef TP_USE_DICTIONARY
+    const char * reference_string;
+    tp_length_t reference_length;
+
+    if(isReference()) {
+        if(!inline_dictionary && getReference() < dictionary_size && dictionary[getReference()] == string)
+            return true;
+        return resolve(getReference(), &reference_string, &reference_length) && \
+            reference_length == strlen(string) && strncmp(string, reference_string, reference_length) == 0;
+    }
+#endif
+    return isString() && contentLength() == strlen(string) && \
+        strncmp(string, (char *)contentStart(), contentLength()) == 0;
 }
 
 bool PackReader::match(char *string) 
@@ -110,25 +192,25 @@ bool PackReader::match(char *string)
 
 bool PackReader::getBoolean()
 {
-    if(cursor->content_length == 0 || !isBoolean())
+    if(contentLength() == 0 || !isBoolean())
         return false;
     else
-        return (bool)cursor->content_start[0];
+        return (bool)contentStart()[0];
 }
 
 tp_integer_t PackReader::getInteger()
 {
     if(isInteger()) {
-        if(cursor->content_length == 1)
-            return (tp_integer_t)((int8_t) cursor->content_start[0]);
-        else if(sizeof(tp_integer_t) >= 2 && cursor->content_length == 2)
-            return (tp_integer_t)((int16_t) cursor->content_start[0] << 8 | \
-                          (int16_t) cursor->content_start[1] << 0 );                
-        else if(sizeof(tp_integer_t) >= 4 && cursor->content_length == 4)
-            return (tp_integer_t)((int32_t) cursor->content_start[0] << 24 | \
-                          (int32_t) cursor->content_start[1] << 16 | \
-                          (int32_t) cursor->content_start[2] <<  8 | \
-                          (int32_t) cursor->content_start[3] <<  0 );
+        if(contentLength() == 1)
+            return (tp_integer_t)((int8_t) contentStart()[0]);
+        else if(sizeof(tp_integer_t) >= 2 && contentLength() == 2)
+            return (tp_integer_t)((int16_t) contentStart()[0] << 8 | \
+                          (int16_t) contentStart()[1] << 0 );                
+        else if(sizeof(tp_integer_t) >= 4 && contentLength() == 4)
+            return (tp_integer_t)((int32_t) contentStart()[0] << 24 | \
+                          (int32_t) contentStart()[1] << 16 | \
+                          (int32_t) contentStart()[2] <<  8 | \
+                          (int32_t) contentStart()[3] <<  0 );
         else
             return 0;
     }
@@ -141,22 +223,22 @@ tp_integer_t PackReader::getInteger()
 tp_real_t PackReader::getReal()
 {
     if(isReal()) {
-        if(cursor->content_length == 4) {
-            uint32_t float_bytes = (uint32_t) cursor->content_start[0] << 24 | \
-                                   (uint32_t) cursor->content_start[1] << 16 | \
-                                   (uint32_t) cursor->content_start[2] <<  8 | \
-                                   (uint32_t) cursor->content_start[3] <<  0 ;
+        if(contentLength() == 4) {
+            uint32_t float_bytes = (uint32_t) contentStart()[0] << 24 | \
+                                   (uint32_t) contentStart()[1] << 16 | \
+                                   (uint32_t) contentStart()[2] <<  8 | \
+                                   (uint32_t) contentStart()[3] <<  0 ;
             return * (float *) &float_bytes;
         }
-        else if(sizeof(tp_real_t) == 8 && cursor->content_length == 8) {
-            uint64_t double_bytes = (uint64_t) cursor->content_start[0] << 56 | \
-                                    (uint64_t) cursor->content_start[1] << 48 | \
-                                    (uint64_t) cursor->content_start[2] << 40 | \
-                                    (uint64_t) cursor->content_start[3] << 32 | \
-                                    (uint64_t) cursor->content_start[4] << 24 | \
-                                    (uint64_t) cursor->content_start[5] << 16 | \
-                                    (uint64_t) cursor->content_start[6] <<  8 | \
-                                    (uint64_t) cursor->content_start[7] <<  0 ;
+        else if(sizeof(tp_real_t) == 8 && contentLength() == 8) {
+            uint64_t double_bytes = (uint64_t) contentStart()[0] << 56 | \
+                                    (uint64_t) contentStart()[1] << 48 | \
+                                    (uint64_t) contentStart()[2] << 40 | \
+                                    (uint64_t) contentStart()[3] << 32 | \
+                                    (uint64_t) contentStart()[4] << 24 | \
+                                    (uint64_t) contentStart()[5] << 16 | \
+                                    (uint64_t) contentStart()[6] <<  8 | \
+                                    (uint64_t) contentStart()[7] <<  0 ;
             return * (double *) &double_bytes;
         }
         else
@@ -170,29 +252,113 @@ tp_real_t PackReader::getReal()
 
 tp_length_t PackReader::getString(char *string, tp_length_t max_length)
 {
-    if(cursor->content_length > max_length - 1)
+#ifdef TP_USE_DICTIONARY
+    const char * reference_string;
+    tp_length_t reference_length;
+
+    if(isReference()) {
+        if(!resolve(getReference(), &reference_string, &reference_length) || reference_length > max_length - 1)
+            return TP_INVALID_LENGTH;
+        memcpy(string, reference_string, reference_length);
+        string[reference_length] = 0;
+        return reference_length;
+    }
+#endif
+    if(contentLength() > max_length - 1)
         return TP_INVALID_LENGTH;
     else {
-        strncpy(string, (char *)cursor->content_start, cursor->content_length);
-        string[cursor->content_length] = 0;
-        return cursor->content_length;
+        strncpy(string, (char *)contentStart(), contentLength());
+        string[contentLength()] = 0;
+        return contentLength();
     }
 }
 
 tp_length_t PackReader::getBytes(uint8_t *bytes, tp_length_t max_length)
 {
-    if(cursor->content_length > max_length)
+    if(contentLength() > max_length)
         return TP_INVALID_LENGTH;
     else {
-        memcpy(bytes, cursor->content_start, cursor->content_length);
-        return cursor->content_length;
+        memcpy(bytes, contentStart(), contentLength());
+        return contentLength();
+    }
+}
+
+bool PackReader::getStringPointer(const char **string, tp_length_t *length)
+{
+#ifdef TP_USE_DICTIONARY
+    if(isReference())
+        return resolve(getReference(), string, length);
+#endif
+    if(!isString())
+        return false;
+    *string = (const char *) contentStart();
+    *length = contentLength();
+    return true;
+}
+
+#ifdef TP_USE_DICTIONARY
+uint16_t PackReader::getReference()
+{
+    if(!isReference())
+        return TP_MAX_REFERENCE;
+    else if(contentLength() == 1)
+        return contentStart()[0];
+    else
+        return (uint16_t) contentStart()[0] << 8 | contentStart()[1];
+}
+
+void PackReader::setDictionary(const char * const * strings, uint16_t count)
+{
+    dictionary = strings;
+    dictionary_size = count;
+}
+
+// Looks up a reference in the strings of an inline dictionary, if any, or else
+// in the dictionary set by the application
+static bool tp_resolve(uint8_t * inline_dictionary, tp_length_t inline_dictionary_length, const char * const * dictionary, uint16_t dictionary_size, \
+                       uint16_t reference, const char ** string, tp_length_t * length)
+{
+    uint8_t * element;
+    tp_length_t available;
+    uint8_t header_length;
+
+    if(inline_dictionary) {
+        element = inline_dictionary;
+        available = inline_dictionary_length;
+        while((header_length = tp_parse_header(element, available, length))) {
+            if(!reference--) {
+                *string = (const char *) element + header_length;
+                return (element[0] & TP_TYPE_MASK) == TP_STRING;
+            }
+            element += header_length + *length;
+            available -= header_length + *length;
+        }
+        return false;
     }
+    else if(reference < dictionary_size) {
+        *string = dictionary[reference];
+        *length = strlen(*string);
+        return true;
+    }
+    else
+        return false;
 }
 
+bool PackReader::resolve(uint16_t reference, const char ** string, tp_length_t * length)
+{
+    // A dictionary found in the pack takes precedence over the one set by the application
+    return tp_resolve(inline_dictionary ? buffer + inline_dictionary : NULL, inline_dictionary_length, \
+                      dictionary, dictionary_size, reference, string, length);
+}
+#endif
+
 /// Writer
 
 PackWriter::PackWriter(uint8_t * buffer, tp_length_t max_length)
 {
+#ifdef TP_USE_DICTIONARY
+    setDictionary(NULL, 0);
+#endif
     setBuffer(buffer, max_length);
 }
 
@@ -326,6 +492,13 @@ bool  PackWriter::putReal(tp_real_t value)
 
 bool  PackWriter::putString(const char *value)
 {
+#ifdef TP_USE_DICTIONARY
+    uint16_t i;
+
+    for(i = 0; i != dictionary_size; i++)
+        if(dictionary[i] == value || !strcmp(dictionary[i], value))
+            return putReference(i);
+#endif
     tp_length_t value_length = strlen(value);
     if(!put(TP_STRING, value_length))
         return false;    
@@ -343,6 +516,61 @@ bool  PackWriter::putBytes(uint8_t *value, tp_length_t value_length)
      return true;
 }
 
+#ifdef TP_USE_DICTIONARY
+bool  PackWriter::putReference(uint16_t value)
+{
+    if(value <= 0xFF) {
+        if(!put(TP_NONE, 1))
+            return false;
+        cursor[0] = value;
+        cursor += 1;
+        return true;
+    }
+    else {
+        if(!put(TP_NONE, 2))
+            return false;
+        cursor[0] = (value >> 8) & 0xFF;
+        cursor[1] = (value >> 0) & 0xFF;
+        cursor += 2;
+        return true;
+    }
+}
+
+bool  PackWriter::putDictionary()
+{
+    tp_length_t string_length;
+    uint16_t i;
+
+    // A dictionary is a None element wrapping a list of non-empty strings,
+    // which makes its content at least three bytes long unlike references
+    if(!dictionary_size || !open(TP_NONE) || !open(TP_LIST))
+        return false;
+    for(i = 0; i != dictionary_size; i++) {
+        string_length = strlen(dictionary[i]);
+        if(!string_length || !put(TP_STRING, string_length))
+            return false;
+        memcpy(cursor, dictionary[i], string_length);
+        cursor += string_length;
+    }
+    return close() && close();
+}
+
+void  PackWriter::setDictionary(const char * const * strings, uint16_t count)
+{
+    dictionary = strings;
+    dictionary_size = count < TP_MAX_REFERENCE ? count : TP_MAX_REFERENCE;
+}
+#endif
+
+bool  PackWriter::putElement(const uint8_t *element, tp_length_t length)
+{
+    if((cursor - buffer_start + length) > buffer_length)
+        return false;
+    memcpy(cursor, element, length);
+    cursor += length;
+    return true;
+}
+
 bool PackWriter::open(uint8_t type)
 {
 #if TP_PACK_SIZE == TP_SMALL_PACK
@@ -424,3 +652,556 @@ bool PackWriter::setOffset(tp_length_t offset)
     else
         return false;
 }
+
+/// Editor
+
+static uint8_t tp_header_width(uint32_t content_length)
+{
+    if(content_length <= TP_SMALL_SIZE_MAX)
+        return 1;
+    #if TP_PACK_SIZE == TP_MEDIUM_PACK ||  TP_PACK_SIZE == TP_BIG_PACK
+    else if(content_length < 0xFFFF)
+        return 3;
+    #endif
+    #if TP_PACK_SIZE == TP_BIG_PACK
+    else if(content_length < 0xFFFFFFFF)
+        return 7;
+    #endif
+    else
+        return 0;
+}
+
+static void tp_write_header(uint8_t * header, uint8_t type, tp_length_t content_length, uint8_t width)
+{
+    if(width == 1)
+        header[0] = type | content_length;
+    else if(width == 3) {
+        header[0] = type | TP_EXTENDED_SIZE_16;
+        header[1] = (content_length >> 8) & 0xFF;
+        header[2] = (content_length >> 0) & 0xFF;
+    }
+    else {
+        header[0] = type | TP_EXTENDED_SIZE_16;
+        header[1] = TP_EXTENDED_SIZE_32 >> 8;
+        header[2] = TP_EXTENDED_SIZE_32 & 0xFF;
+        header[3] = ((uint32_t) content_length >> 24) & 0xFF;
+        header[4] = ((uint32_t) content_length >> 16) & 0xFF;
+        header[5] = ((uint32_t) content_length >>  8) & 0xFF;
+        header[6] = ((uint32_t) content_length >>  0) & 0xFF;
+    }
+}
+
+PackEditor::PackEditor(uint8_t * buffer, tp_length_t length, tp_length_t max_length)
+{
+    setBuffer(buffer, length, max_length);
+}
+
+void PackEditor::setBuffer(uint8_t * buffer, tp_length_t length, tp_length_t buffer_max_length)
+{
+    PackReader::setBuffer(buffer, length);
+    max_length = buffer_max_length;
+}
+
+bool PackEditor::splice(const uint8_t * header, tp_length_t header_length, const uint8_t * content, tp_length_t content_length)
+{
+    struct level * cursor = &levels[depth];
+    struct level * level;
+    struct level * inner;
+    uint8_t * start = elementStart();
+    uint8_t * end = buffer + buffer_length;
+    uint8_t * container;
+    tp_length_t old_length = elementLength();
+    tp_length_t new_length = header_length + content_length;
+    tp_length_t parsed_length;
+    uint8_t parsed_width, width, shift;
+    int32_t delta, growth;
+
+    // There must be a current element and the new one must be well formed
+    parsed_width = tp_parse_header((uint8_t *) header, new_length, &parsed_length);
+    if(cursor->element_offset < parentStart() || !cursor->header_length || \
+       !parsed_width || parsed_width > header_length || parsed_width + parsed_length != new_length)
+        return false;
+
+    // Check first that the pack fits once the headers of the enclosing
+    // containers grow, so the buffer is never left half modified
+    delta = (int32_t) new_length - old_length;
+    growth = delta;
+    for(level = cursor; level != &levels[0]; level--) {
+        width = tp_header_width((level - 1)->content_length + growth);
+        if(!width || (int32_t) (level - 1)->content_length + growth >= (int32_t) TP_INVALID_LENGTH)
+            return false;
+        if(width > (level - 1)->header_length)
+            growth += width - (level - 1)->header_length;
+    }
+    if((int32_t) buffer_length + growth > (int32_t) max_length)
+        return false;
+
+    // Move the tail once and put the new element in place
+    memmove(start + new_length, start + old_length, end - start - old_length);
+    memcpy(start, header, header_length);
+    if(content_length)
+        memcpy(start + header_length, content, content_length);
+    end += delta;
+    cursor->header_length = parsed_width;
+    cursor->content_length = parsed_length;
+
+    // Update the lengths of the enclosing containers, keeping the width of
+    // their headers unless the new length does not fit
+    for(level = cursor; level != &levels[0]; level--) {
+        container = buffer + (level - 1)->element_offset;
+        (level - 1)->content_length += delta;
+        width = tp_header_width((level - 1)->content_length);
+        if(width > (level - 1)->header_length) {
+            shift = width - (level - 1)->header_length;
+            memmove(container + width, container + width - shift, end - (container + width - shift));
+            end += shift;
+            delta += shift;
+            for(inner = level; inner <= cursor; inner++)
+                inner->element_offset += shift;
+        }
+        else
+            width = (level - 1)->header_length;
+        tp_write_header(container, container[0] & TP_TYPE_MASK, (level - 1)->content_length, width);
+        (level - 1)->header_length = width;
+    }
+    buffer_length += delta;
+    return true;
+}
+
+bool PackEditor::replace(const uint8_t * element, tp_length_t length)
+{
+    return splice(element, length, NULL, 0);
+}
+
+bool PackEditor::setNone()
+{
+    uint8_t element = TP_NONE;
+    return splice(&element, 1, NULL, 0);
+}
+
+bool PackEditor::setBoolean(bool value)
+{
+    uint8_t element[2];
+    PackWriter writer(element, sizeof(element));
+    return writer.putBoolean(value) && splice(element, writer.getOffset(), NULL, 0);
+}
+
+bool PackEditor::setInteger(tp_integer_t value)
+{
+    uint8_t element[1 + sizeof(tp_integer_t)];
+    PackWriter writer(element, sizeof(element));
+    return writer.putInteger(value) && splice(element, writer.getOffset(), NULL, 0);
+}
+
+bool PackEditor::setReal(tp_real_t value)
+{
+    uint8_t element[1 + sizeof(tp_real_t)];
+    PackWriter writer(element, sizeof(element));
+    return writer.putReal(value) && splice(element, writer.getOffset(), NULL, 0);
+}
+
+bool PackEditor::setString(const char *value)
+{
+    uint8_t header[7];
+    tp_length_t value_length = strlen(value);
+    uint8_t width = tp_header_width(value_length);
+    if(!width)
+        return false;
+    tp_write_header(header, TP_STRING, value_length, width);
+    return splice(header, width, (const uint8_t *) value, value_length);
+}
+
+bool PackEditor::setBytes(uint8_t *value, tp_length_t length)
+{
+    uint8_t header[7];
+    uint8_t width = tp_header_width(length);
+    if(!width)
+        return false;
+    tp_write_header(header, TP_BYTES, length, width);
+    return splice(header, width, value, length);
+}
+
+/// Delta
+
+static tp_length_t tp_count_elements(uint8_t * start, tp_length_t length)
+{
+    tp_length_t count = 0;
+    tp_length_t content_length;
+    uint8_t header_length;
+
+    while(length && (header_length = tp_parse_header(start, length, &content_length))) {
+        start += header_length + content_length;
+        length -= header_length + content_length;
+        count += 1;
+    }
+    return length ? TP_INVALID_LENGTH : count;
+}
+
+// A delta is a list of patches. Every patch is a list with the position of
+// the replaced element at each nesting level, followed by the new element.
+// Packs are walked with step() so dictionary elements are compared and
+// patched like any other element.
+tp_length_t PackDelta::encode(uint8_t * baseline, tp_length_t baseline_length, uint8_t * pack, tp_length_t pack_length, uint8_t * delta, tp_length_t max_length)
+{
+    PackReader old_reader(baseline, baseline_length);
+    PackReader new_reader(pack, pack_length);
+    PackWriter writer(delta, max_length);
+    tp_length_t path[TP_MAX_LEVELS];
+    tp_length_t count;
+    uint8_t depth = 0;
+    uint8_t i;
+    bool has_old, has_new;
+
+    count = tp_count_elements(baseline, baseline_length);
+    if(count == TP_INVALID_LENGTH || count != tp_count_elements(pack, pack_length) || !writer.openList())
+        return TP_INVALID_LENGTH;
+
+    path[0] = 0;
+    while(true) {
+        has_old = old_reader.step();
+        has_new = new_reader.step();
+        if(has_old != has_new)
+            return TP_INVALID_LENGTH;
+        else if(!has_old) {
+            if(!depth)
+                break;
+            old_reader.close();
+            new_reader.close();
+            depth -= 1;
+            path[depth] += 1;
+            continue;
+        }
+
+        // Unchanged elements are left out of the delta
+        if(old_reader.elementLength() == new_reader.elementLength() && \
+           !memcmp(old_reader.elementStart(), new_reader.elementStart(), new_reader.elementLength())) {
+            path[depth] += 1;
+            continue;
+        }
+
+        // Containers with the same number of elements are compared element by element
+        if(old_reader.isContainer() && old_reader.getType() == new_reader.getType() && depth + 1 < TP_MAX_LEVELS) {
+            count = tp_count_elements(old_reader.contentStart(), old_reader.contentLength());
+            if(count && count != TP_INVALID_LENGTH && \
+               count == tp_count_elements(new_reader.contentStart(), new_reader.contentLength()) && \
+               old_reader.open() && new_reader.open()) {
+                depth += 1;
+                path[depth] = 0;
+                continue;
+            }
+        }
+
+        if(!writer.openList())
+            return TP_INVALID_LENGTH;
+        for(i = 0; i <= depth; i++)
+            if(!writer.putInteger(path[i]))
+                return TP_INVALID_LENGTH;
+        if(!writer.putElement(new_reader.elementStart(), new_reader.elementLength()) || !writer.close())
+            return TP_INVALID_LENGTH;
+        path[depth] += 1;
+    }
+    return writer.close() ? writer.getOffset() : TP_INVALID_LENGTH;
+}
+
+// Walks the editor to the element addressed by a patch and leaves the patch
+// reader on the new element
+bool PackDelta::locate(PackReader &patch, PackEditor &editor, tp_length_t * path, uint8_t * depth)
+{
+    tp_integer_t index;
+
+    *depth = 0;
+    while(patch.step()) {
+        if(!patch.hasNext())
+            return *depth != 0;
+        if(!patch.isInteger() || (index = patch.getInteger()) < 0 || (*depth && !editor.open()))
+            return false;
+        path[(*depth)++] = index;
+        for(; index >= 0; index--)
+            if(!editor.step())
+                return false;
+    }
+    return false;
+}
+
+tp_length_t PackDelta::apply(uint8_t * buffer, tp_length_t length, tp_length_t max_length, uint8_t * delta, tp_length_t delta_length)
+{
+    PackReader patches(delta, delta_length);
+    PackEditor editor;
+    tp_length_t path[TP_MAX_LEVELS];
+    tp_length_t previous[TP_MAX_LEVELS];
+    uint8_t depth, previous_depth = 0;
+    uint8_t i;
+    int32_t growth = 0;
+
+    if(!patches.step() || !patches.isList())
+        return TP_INVALID_LENGTH;
+    if(!patches.contentLength())
+        return length;
+
+    // Check every patch before the first change, so a bad delta leaves the
+    // pack untouched. The patches must be in pack order and none of them can
+    // be inside another, so their positions are the same before and after.
+    patches.open();
+    while(patches.step()) {
+        editor.setBuffer(buffer, length, max_length);
+        if(!patches.openList() || !locate(patches, editor, path, &depth) || \
+           patches.elementStart() + patches.elementLength() > delta + delta_length)
+            return TP_INVALID_LENGTH;
+        for(i = 0; i != depth && i != previous_depth && path[i] == previous[i]; i++)
+            ;
+        if(previous_depth && (i == depth || i == previous_depth || path[i] < previous[i]))
+            return TP_INVALID_LENGTH;
+        memcpy(previous, path, sizeof(path));
+        previous_depth = depth;
+
+        // Worst case, the headers of the enclosing containers grow to the
+        // widest size, once each. The first i of them were already counted
+        // with the previous patch.
+        if(patches.elementLength() > editor.elementLength())
+            growth += patches.elementLength() - editor.elementLength();
+        for(; i + 1 < depth; i++)
+            growth += tp_header_width(TP_INVALID_LENGTH - 1) - editor.levels[i].header_length;
+        patches.close();
+    }
+    if((int32_t) length + growth > (int32_t) max_length)
+        return TP_INVALID_LENGTH;
+
+    patches.setBuffer(delta, delta_length);
+    patches.step();
+    patches.open();
+    while(patches.step()) {
+        editor.setBuffer(buffer, length, max_length);
+        patches.openList();
+        if(!locate(patches, editor, path, &depth) || !editor.replace(patches.elementStart(), patches.elementLength()))
+            return TP_INVALID_LENGTH;
+        length = editor.getLength();
+        patches.close();
+    }
+    return length;
+}
+
+tp_length_t PackDelta::rebuild(uint8_t * baseline, tp_length_t baseline_length, uint8_t * delta, tp_length_t delta_length, uint8_t * buffer, tp_length_t max_length)
+{
+    if(baseline_length > max_length)
+        return TP_INVALID_LENGTH;
+    memmove(buffer, baseline, baseline_length);
+    return apply(buffer, baseline_length, max_length, delta, delta_length);
+}
+
+/// Tree
+
+static tp_length_t tp_hash(const uint8_t * bytes, tp_length_t length, tp_length_t map)
+{
+    uint16_t hash = 0x811C;     // truncated FNV-1a, good enough for short keys
+
+    while(length--)
+        hash = (hash ^ *bytes++) * 0x0193;
+    return (tp_length_t)(hash ^ (uint16_t)(map * 0x9E37u));
+}
+
+PackTree::PackTree(void * arena, size_t length)
+{
+#ifdef TP_USE_DICTIONARY
+    setDictionary(NULL, 0);
+#endif
+    setArena(arena, length);
+}
+
+#ifdef TP_USE_DICTIONARY
+void PackTree::setDictionary(const char * const * strings, uint16_t count)
+{
+    dictionary = strings;
+    dictionary_size = count;
+}
+#endif
+
+void PackTree::setArena(void * arena, size_t length)
+{
+    uint8_t padding = (sizeof(tp_length_t) - (uintptr_t) arena % sizeof(tp_length_t)) % sizeof(tp_length_t);
+
+    arena_start = (uint8_t *) arena + padding;
+    arena_length = length > padding ? length - padding : 0;
+    nodes = (struct node *) arena_start;
+    max_nodes = arena_length / sizeof(struct node) < TP_INVALID_LENGTH ? \
+        arena_length / sizeof(struct node) : TP_INVALID_LENGTH - 1;
+    node_count = 0;
+    table_mask = 0;
+}
+
+bool PackTree::build(uint8_t * pack, tp_length_t length)
+{
+    struct node * parent;
+    struct node * child;
+    tp_length_t position, end, content_length, keys, slot, i, j;
+    size_t size;
+    uint8_t header_length;
+    const char * key;
+    tp_length_t key_length;
+#ifdef TP_USE_DICTIONARY
+    uint8_t list_header_length;
+#endif
+
+    buffer = pack;
+    node_count = 0;
+    table_mask = 0;
+#ifdef TP_USE_DICTIONARY
+    inline_dictionary = 0;
+#endif
+    if(!max_nodes)
+        return false;
+
+    // The document itself is the root node, a list holding the top level elements
+    nodes[0].type = TP_LIST;
+    nodes[0].header_length = 0;
+    nodes[0].offset = 0;
+    nodes[0].length = length;
+    nodes[0].parent = TP_INVALID_LENGTH;
+    node_count = 1;
+
+    // Breadth-first, so the children of every container end up next to each other
+    keys = 0;
+    for(i = 0; i != node_count; i++) {
+        parent = &nodes[i];
+        parent->child = node_count;
+        parent->children = 0;
+        if((parent->type & TP_FAMILY_MASK) != TP_CONTAINER)
+            continue;
+        position = parent->offset + parent->header_length;
+        end = position + parent->length;
+        while(position != end) {
+            header_length = tp_parse_header(buffer + position, end - position, &content_length);
+            if(!header_length || node_count == max_nodes) {
+                node_count = 0;
+                return false;
+            }
+#ifdef TP_USE_DICTIONARY
+            // A single dictionary is supported, at the top level, and it is
+            // left out of the tree as PackReader::next() skips it
+            if((buffer[position] & TP_TYPE_MASK) == TP_NONE && content_length > 2) {
+                list_header_length = tp_parse_header(buffer + position + header_length, content_length, &inline_dictionary_length);
+                if(i != 0 || inline_dictionary || !list_header_length || (buffer[position + header_length] & TP_TYPE_MASK) != TP_LIST) {
+                    node_count = 0;
+                    return false;
+                }
+                inline_dictionary = position + header_length + list_header_length;
+                position += header_length + content_length;
+                continue;
+            }
+#endif
+            child = &nodes[node_count];
+            child->type = buffer[position] & TP_TYPE_MASK;
+            child->header_length = header_length;
+            child->offset = position;
+            child->length = content_length;
+            child->parent = i;
+            node_count += 1;
+            parent->children += 1;
+            if(parent->type == TP_MAP && (parent->children & 1) && (child->type == TP_STRING || (child->type == TP_NONE && content_length)))
+                keys += 1;
+            position += header_length + content_length;
+        }
+    }
+
+    // Index the string keys of all the maps, references resolved, in a hash
+    // table placed after the nodes
+    if(keys) {
+        table = (tp_length_t *) &nodes[node_count];
+        size = (arena_length - node_count * sizeof(struct node)) / sizeof(tp_length_t);
+        for(slot = 1; slot < keys * 2 && slot < TP_INVALID_LENGTH / 2; slot <<= 1);
+        while(slot > size)
+            slot >>= 1;
+        if(slot > keys) {
+            table_mask = slot - 1;
+            memset(table, 0, slot * sizeof(tp_length_t));
+            for(i = 0; i != node_count; i++) {
+                if(nodes[i].type != TP_MAP)
+                    continue;
+                for(j = nodes[i].child; j + 1 < nodes[i].child + nodes[i].children; j += 2) {
+                    if(!getStringPointer(j, &key, &key_length))
+                        continue;
+                    slot = tp_hash((const uint8_t *) key, key_length, i) & table_mask;
+                    while(table[slot])
+                        slot = (slot + 1) & table_mask;
+                    table[slot] = j;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+tp_length_t PackTree::getChild(tp_length_t node, tp_length_t index)
+{
+    return index < nodes[node].children ? nodes[node].child + index : TP_INVALID_LENGTH;
+}
+
+tp_length_t PackTree::getNext(tp_length_t node)
+{
+    tp_length_t parent = nodes[node].parent;
+
+    if(parent == TP_INVALID_LENGTH || node + 1 == nodes[parent].child + nodes[parent].children)
+        return TP_INVALID_LENGTH;
+    else
+        return node + 1;
+}
+
+bool PackTree::getStringPointer(tp_length_t node, const char **string, tp_length_t *length)
+{
+#ifdef TP_USE_DICTIONARY
+    uint8_t * content = contentStart(node);
+
+    // References before the dictionary of the pack use the one of the application
+    if(nodes[node].type == TP_NONE && nodes[node].length && nodes[node].length <= 2)
+        return tp_resolve(inline_dictionary && nodes[node].offset > inline_dictionary ? buffer + inline_dictionary : NULL, inline_dictionary_length, \
+                          dictionary, dictionary_size, nodes[node].length == 1 ? content[0] : (uint16_t) content[0] << 8 | content[1], string, length);
+#endif
+    if(nodes[node].type != TP_STRING)
+        return false;
+    *string = (const char *) contentStart(node);
+    *length = nodes[node].length;
+    return true;
+}
+
+bool PackTree::compare(tp_length_t node, const char *string, tp_length_t length)
+{
+    const char * node_string;
+    tp_length_t node_length;
+
+    return getStringPointer(node, &node_string, &node_length) && node_length == length && \
+        memcmp(string, node_string, length) == 0;
+}
+
+bool PackTree::equals(tp_length_t node, const char *string)
+{
+    return compare(node, string, strlen(string));
+}
+
+tp_length_t PackTree::find(tp_length_t map, const char *key)
+{
+    tp_length_t key_length = strlen(key);
+    tp_length_t slot, i;
+
+    if(map >= node_count || nodes[map].type != TP_MAP)
+        return TP_INVALID_LENGTH;
+
+    if(table_mask) {
+        slot = tp_hash((const uint8_t *) key, key_length, map) & table_mask;
+        for(; table[slot]; slot = (slot + 1) & table_mask)
+            if(nodes[table[slot]].parent == map && compare(table[slot], key, key_length))
+                return table[slot] + 1;
+    }
+    else {
+        for(i = nodes[map].child; i + 1 < nodes[map].child + nodes[map].children; i += 2)
+            if(compare(i, key, key_length))
+                return i + 1;
+    }
+    return TP_INVALID_LENGTH;
+}
+
+bool PackTree::getReader(tp_length_t node, PackReader &reader)
+{
+    if(node >= node_count)
+        return false;
+    reader.setBuffer(elementStart(node), elementLength(node));
+    return node == 0 || reader.next();
+}
@@ -78,59 +78,94 @@ typedef uint32_t tp_length_t;
 #define TP_BLOCK        0b10000000
 #define TP_CONTAINER    0b11000000
 
+#define TP_REFERENCE_8   (TP_NONE | 1)
+#define TP_REFERENCE_16  (TP_NONE | 2)
+#define TP_MAX_REFERENCE 0xFFFF
+
 
 
 class PackReader {
-    private:
+    friend class PackDelta;
+
+    protected:
+        // Offsets are relative to the buffer, and the parent of each level is
+        // the content of the previous one, or the whole buffer for level 0
+        uint8_t * buffer;
+        tp_length_t buffer_length;
         struct level {
-            uint8_t * element_start;
-            uint8_t * content_start;
-            uint8_t * parent_start;
-            tp_length_t element_length;
-            tp_length_t content_length;            
-            tp_length_t parent_length;
+            tp_length_t element_offset;
+            tp_length_t content_length;
+            uint8_t header_length;
         } levels[TP_MAX_LEVELS];
-        struct level * cursor;
+        uint8_t depth;
+#ifdef TP_USE_DICTIONARY
+        const char * const * dictionary;
+        uint16_t dictionary_size;
+        tp_length_t inline_dictionary;          // offset of the first string, 0 if none
+        tp_length_t inline_dictionary_length;
+
+        bool resolve(uint16_t reference, const char ** string, tp_length_t * length);
+#endif
+        bool step();
+        tp_length_t parentStart()   { return depth ? levels[depth - 1].element_offset + levels[depth - 1].header_length : 0; };
+        tp_length_t parentEnd()     { return depth ? parentStart() + levels[depth - 1].content_length : buffer_length; };
 
     public:
+#ifdef TP_USE_DICTIONARY
+        PackReader() { setDictionary(NULL, 0); };
+#else
         PackReader() {};
+#endif
         PackReader(uint8_t * buffer, tp_length_t length);
         void setBuffer(uint8_t * buffer, tp_length_t length);
     
-        uint8_t getType() { return (cursor->element_start[0] & TP_TYPE_MASK); };
-        bool isNone()        { return getType() == TP_NONE; };
+        uint8_t getType() { return (elementStart()[0] & TP_TYPE_MASK); };
         bool isBoolean()     { return getType() == TP_BOOLEAN; };
         bool isInteger()     { return getType() == TP_INTEGER; };
         bool isReal()        { return getType() == TP_REAL; };
+#ifdef TP_USE_DICTIONARY
+        bool isNone()        { return getType() == TP_NONE && !isReference(); };
+        bool isString()      { return getType() == TP_STRING || isReference(); };
+        bool isReference()   { return getType() == TP_NONE && contentLength() && contentLength() <= 2; };
+#else
+        bool isNone()        { return getType() == TP_NONE; };
         bool isString()      { return getType() == TP_STRING; };
+#endif
         bool isBytes()       { return getType() == TP_BYTES; };
         bool isList()        { return getType() == TP_LIST; };
         bool isMap()         { return getType() == TP_MAP; };
-        bool isNumber()      { return (cursor->element_start[0] & TP_FAMILY_MASK) == TP_NUMBER; };
-        bool isBlock()       { return (cursor->element_start[0] & TP_FAMILY_MASK) == TP_BLOCK; };
-        bool isContainer()   { return (cursor->element_start[0] & TP_FAMILY_MASK) == TP_CONTAINER; };
+        bool isNumber()      { return (elementStart()[0] & TP_FAMILY_MASK) == TP_NUMBER; };
+        bool isBlock()       { return (elementStart()[0] & TP_FAMILY_MASK) == TP_BLOCK; };
+        bool isContainer()   { return (elementStart()[0] & TP_FAMILY_MASK) == TP_CONTAINER; };
 
         bool          getBoolean();
         tp_integer_t  getInteger();
         tp_real_t     getReal();
         tp_length_t   getString(char *string, tp_length_t max_length);
         tp_length_t   getBytes(uint8_t *bytes, tp_length_t max_length);
+        bool          getStringPointer(const char **string, tp_length_t *length);
+#ifdef TP_USE_DICTIONARY
+        uint16_t      getReference();
+
+        void setDictionary(const char * const * strings, uint16_t count);
+#endif
 
         bool equals(char *string);
         bool match(char *string);
         
         bool next();
-        bool hasNext()       { return cursor->element_start + cursor->element_length < cursor->parent_start + cursor->parent_length; };
+        bool hasNext()       { return levels[depth].element_offset + elementLength() < parentEnd(); };
         
-        uint8_t *    elementStart()  { return cursor->element_start; };
-        tp_length_t  elementLength() { return cursor->element_length; };
-        uint8_t *    contentStart()  { return cursor->content_start; };
-        tp_length_t  contentLength() { return cursor->content_length; };
+        // Raw bytes of the element, so a reference gives its index and not the string
+        uint8_t *    elementStart()  { return buffer + levels[depth].element_offset; };
+        tp_length_t  elementLength() { return levels[depth].header_length + levels[depth].content_length; };
+        uint8_t *    contentStart()  { return elementStart() + levels[depth].header_length; };
+        tp_length_t  contentLength() { return levels[depth].content_length; };
         
         bool open();
         bool openList() { return isList() && open(); };
         bool openMap()  { return isMap() && open(); };
-        bool close()    { return cursor != &levels[0] ? cursor--, true : false; };       
+        bool close()    { return depth ? depth--, true : false; };       
 };
 
 
@@ -143,8 +178,16 @@ class PackWriter {
         uint8_t * cursor;
         uint8_t * container_start[TP_MAX_LEVELS];
         uint8_t level;
+#ifdef TP_USE_DICTIONARY
+        const char * const * dictionary;
+        uint16_t dictionary_size;
+#endif
     public:
+#ifdef TP_USE_DICTIONARY
+        PackWriter() { setDictionary(NULL, 0); };
+#else
         PackWriter() {};
+#endif
         PackWriter(uint8_t * buffer, tp_length_t max_length);
         void setBuffer(uint8_t * buffer, tp_length_t max_length);
 
@@ -154,6 +197,13 @@ class PackWriter {
         bool  putReal(tp_real_t value);
         bool  putString(const char *value);
         bool  putBytes(uint8_t *value, tp_length_t length);
+        bool  putElement(const uint8_t *element, tp_length_t length);
+#ifdef TP_USE_DICTIONARY
+        bool  putReference(uint16_t value);
+        bool  putDictionary();
+
+        void  setDictionary(const char * const * strings, uint16_t count);
+#endif
     
         bool  open(uint8_t type);
         bool  openList() { return open(TP_LIST); };
@@ -164,4 +214,101 @@ class PackWriter {
         bool  setOffset(tp_length_t offset);
 };
 
+
+
+class PackEditor : public PackReader {
+    private:
+        tp_length_t max_length;
+
+        bool splice(const uint8_t * header, tp_length_t header_length, const uint8_t * content, tp_length_t content_length);
+
+    public:
+        PackEditor() {};
+        PackEditor(uint8_t * buffer, tp_length_t length, tp_length_t max_length);
+        void setBuffer(uint8_t * buffer, tp_length_t length, tp_length_t max_length);
+
+        bool  replace(const uint8_t * element, tp_length_t length);
+        bool  setNone();
+        bool  setBoolean(bool value);
+        bool  setInteger(tp_integer_t value);
+        bool  setReal(tp_real_t value);
+        bool  setString(const char *value);
+        bool  setBytes(uint8_t *value, tp_length_t length);
+
+        tp_length_t  getLength() { return buffer_length; };
+};
+
+
+
+class PackDelta {
+    private:
+        static bool locate(PackReader &patch, PackEditor &editor, tp_length_t * path, uint8_t * depth);
+
+    public:
+        static tp_length_t encode(uint8_t * baseline, tp_length_t baseline_length, uint8_t * pack, tp_length_t pack_length, uint8_t * delta, tp_length_t max_length);
+        static tp_length_t apply(uint8_t * buffer, tp_length_t length, tp_length_t max_length, uint8_t * delta, tp_length_t delta_length);
+        static tp_length_t rebuild(uint8_t * baseline, tp_length_t baseline_length, uint8_t * delta, tp_length_t delta_length, uint8_t * buffer, tp_length_t max_length);
+};
+
+
+
+class PackTree {
+    private:
+        struct node {
+            uint8_t type;
+            uint8_t header_length;
+            tp_length_t offset;
+            tp_length_t length;
+            tp_length_t parent;
+            tp_length_t child;
+            tp_length_t children;
+        };
+        uint8_t * arena_start;
+        size_t arena_length;
+        uint8_t * buffer;
+        struct node * nodes;
+        tp_length_t node_count;
+        tp_length_t max_nodes;
+        tp_length_t * table;
+        tp_length_t table_mask;
+#ifdef TP_USE_DICTIONARY
+        const char * const * dictionary;
+        uint16_t dictionary_size;
+        tp_length_t inline_dictionary;          // offset of the first string, 0 if none
+        tp_length_t inline_dictionary_length;
+#endif
+
+        bool compare(tp_length_t node, const char *string, tp_length_t length);
+
+    public:
+#ifdef TP_USE_DICTIONARY
+        PackTree() { setDictionary(NULL, 0); };
+#else
+        PackTree() {};
+#endif
+        PackTree(void * arena, size_t length);
+        void setArena(void * arena, size_t length);
+        bool build(uint8_t * buffer, tp_length_t length);
+
+        tp_length_t  getCount()                                { return node_count; };
+        tp_length_t  getRoot()                                 { return 0; };
+        uint8_t      getType(tp_length_t node)                 { return nodes[node].type; };
+        tp_length_t  getParent(tp_length_t node)               { return nodes[node].parent; };
+        tp_length_t  getChildCount(tp_length_t node)           { return nodes[node].children; };
+        tp_length_t  getChild(tp_length_t node, tp_length_t index);
+        tp_length_t  getNext(tp_length_t node);
+        tp_length_t  find(tp_length_t map, const char *key);
+        bool         equals(tp_length_t node, const char *string);
+        bool         getStringPointer(tp_length_t node, const char **string, tp_length_t *length);
+        bool         getReader(tp_length_t node, PackReader &reader);
+#ifdef TP_USE_DICTIONARY
+        void         setDictionary(const char * const * strings, uint16_t count);
+#endif
+
+        uint8_t *    elementStart(tp_length_t node)  { return buffer + nodes[node].offset; };
+        tp_length_t  elementLength(tp_length_t node) { return nodes[node].header_length + nodes[node].length; };
+        uint8_t *    contentStart(tp_length_t node)  { return buffer + nodes[node].offset + nodes[node].header_length; };
+        tp_length_t  contentLength(tp_length_t node) { return nodes[node].length; };
+};
+
 #endif
\ No newline at end of file
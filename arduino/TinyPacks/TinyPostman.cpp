@@ -26,6 +26,10 @@
 Postman::Postman()
 {
     registered_resources = 0;
+#ifdef TPM_USE_METRICS
+    requests = client_errors = 0;
+    framer = NULL;
+#endif
 }
 
 bool Postman::registerResource(const char * path, Resource &resource)
@@ -33,6 +37,10 @@ bool Postman::registerResource(const char * path, Resource &resource)
     if(registered_resources < TPM_MAX_RESOURCES) {
         resources[registered_resources].path = path;
         resources[registered_resources].resource = &resource;
+#ifdef TPM_USE_METRICS
+        resources[registered_resources].max_time = 0;
+        memset(resources[registered_resources].histogram, 0, sizeof(resources[registered_resources].histogram));
+#endif
         registered_resources += 1;
         return true;
     }
@@ -40,34 +48,68 @@ bool Postman::registerResource(const char * path, Resource &resource)
         return false;
 }
 
+#ifdef TP_USE_DICTIONARY
+void Postman::setDictionary(const char * const * strings, uint16_t count)
+{
+    request.reader.setDictionary(strings, count);
+    request.writer.setDictionary(strings, count);
+}
+#endif
+
 tp_length_t Postman::handlePack(uint8_t * buffer, tp_length_t length, tp_length_t max_length) 
+{
+    return handlePack(buffer, length, buffer, max_length);
+}
+
+tp_length_t Postman::handlePack(uint8_t * request_buffer, tp_length_t length, uint8_t * response_buffer, tp_length_t max_length) 
 {
     uint8_t method;
     uint8_t response;
     uint8_t i;
+    tp_length_t token_end = 2;
+    tp_integer_t revision = 0;
     
-    request.reader.setBuffer(buffer, length);
-    request.writer.setBuffer(buffer, max_length - 2);
+    request.reader.setBuffer(request_buffer, length);
+    request.writer.setBuffer(response_buffer, max_length - 2);
     request.writer.setOffset(2);
 
     if(!request.reader.next() || !request.reader.isInteger() || !(method = request.reader.getInteger()))
         response = TPM_400_Bad_Request;
-    else if(!request.reader.next() || !request.writer.setOffset(request.reader.elementStart() + request.reader.elementLength() - buffer))
+    else if(!request.reader.next() || \
+            !request.writer.setOffset(token_end = request.reader.elementStart() + request.reader.elementLength() - request_buffer))
         response = TPM_400_Bad_Request;        
     else if(!request.reader.next() || !request.reader.isString() || request.reader.getString(request.path, TPM_MAX_PATH_LENGTH) == TP_INVALID_LENGTH)
         response = TPM_400_Bad_Request;
-    else if(method == TPM_GET && !request.path[0]) {
+    else if(method == (TPM_GET | TPM_CONDITIONAL) && (!request.reader.next() || !request.reader.isInteger()))
+        response = TPM_400_Bad_Request;
+    else if((method & ~TPM_CONDITIONAL) == TPM_GET && !request.path[0]) {
         request.writer.openList();
         for(i = 0; i != registered_resources; i++)
             request.writer.putString(resources[i].path);
         request.writer.close();
         response = TPM_205_Content;
     }
+#ifdef TPM_USE_METRICS
+    else if((method & ~TPM_CONDITIONAL) == TPM_GET && !strcmp(request.path, TPM_METRICS_PATH))
+        response = putMetrics() ? TPM_205_Content : TPM_413_Request_Entity_Too_Large;
+#endif
     else {
         for(i = 0; i != registered_resources; i++) {
             if(!strcmp(resources[i].path, request.path)) {
+#ifdef TPM_USE_METRICS
+                uint32_t time = TPM_CLOCK();
+                uint8_t bucket = 0;
+#endif
                 if(method == TPM_GET) 
                     response = resources[i].resource->get(request);
+                else if(method == (TPM_GET | TPM_CONDITIONAL)) {
+                    // The reader is left on the revision known by the client
+                    revision = resources[i].resource->revision(request);
+                    if(revision && revision == request.reader.getInteger())
+                        response = TPM_203_Valid;
+                    else
+                        response = resources[i].resource->get(request);
+                }
                 else if(method == TPM_POST) 
                     response = resources[i].resource->post(request);
                 else if(method == TPM_PUT) 
@@ -76,37 +118,158 @@ tp_length_t Postman::handlePack(uint8_t * buffer, tp_length_t length, tp_length_
                     response = resources[i].resource->del(request);
                 else
                     response = TPM_400_Bad_Request;
+#ifdef TPM_USE_METRICS
+                time = TPM_CLOCK() - time;
+                if(time > resources[i].max_time)
+                    resources[i].max_time = time;
+                for(time >>= 4; time && bucket != TPM_METRICS_BUCKETS - 1; time >>= 2)
+                    bucket++;
+                resources[i].histogram[bucket]++;
+#endif
                 break;
             }
         }
         if(i == registered_resources)
             response = TPM_404_Not_Found;
     }
-    buffer[0] = TP_INTEGER | 1;
-    buffer[1] = response;
+    if(response == TPM_205_Content && (method & TPM_CONDITIONAL) && !request.writer.putInteger(revision))
+        response = TPM_413_Request_Entity_Too_Large;
+#ifdef TPM_USE_METRICS
+    requests++;
+    if((response & 0xE0) == 0x40)
+        client_errors++;
+#endif
+    // The token is already in place when the request and the response share the buffer
+    if(response_buffer != request_buffer && token_end <= request.writer.getOffset())
+        memcpy(response_buffer + 2, request_buffer + 2, token_end - 2);
+    response_buffer[0] = TP_INTEGER | 1;
+    response_buffer[1] = response;
     return request.writer.getOffset();
 }
 
+#ifdef TPM_USE_METRICS
+bool Postman::putMetrics()
+{
+    uint8_t i, j;
+    PackWriter &writer = request.writer;
+
+    if(!writer.openMap() || \
+       !writer.putString("requests") || !writer.putInteger(requests) || \
+       !writer.putString("client_errors") || !writer.putInteger(client_errors))
+        return false;
+    if(framer && \
+       (!writer.putString("frames") || !writer.putInteger(framer->metrics.frames) || \
+        !writer.putString("crc_errors") || !writer.putInteger(framer->metrics.crc_errors) || \
+        !writer.putString("overruns") || !writer.putInteger(framer->metrics.overruns)))
+        return false;
+    if(!writer.putString("resources") || !writer.openMap())
+        return false;
+    for(i = 0; i != registered_resources; i++) {
+        if(!writer.putString(resources[i].path) || !writer.openMap() || \
+           !writer.putString("max_time") || !writer.putInteger(resources[i].max_time) || \
+           !writer.putString("histogram") || !writer.openList())
+            return false;
+        for(j = 0; j != TPM_METRICS_BUCKETS; j++)
+            if(!writer.putInteger(resources[i].histogram[j]))
+                return false;
+        if(!writer.close() || !writer.close())
+            return false;
+    }
+    return writer.close() && writer.close();
+}
+#endif
+
 
 // Framer
 
 Framer::Framer(uint8_t * pack_buffer, tp_length_t pack_max_length) {
-    buffer = pack_buffer;
+    buffer = tx_buffer = pack_buffer;
     max_length = pack_max_length;
-    state = TPM_RECEIVING;
-    crc = crc1 = crc2 = 0;
-    length = 0;
-    index = 0;
+    length = tx_length = 0;
+#ifdef TPM_USE_METRICS
+    overrun = false;
+    metrics.frames = metrics.crc_errors = metrics.overruns = 0;
+#endif
+#ifdef TPM_USE_COMPRESSION
+    peer_compression = false;
+#endif
+    resetReceiver();
+    setState(TPM_RECEIVING);
+}
+
+// With separate buffers, a new request can be received while the previous response is sent
+Framer::Framer(uint8_t * receive_buffer, tp_length_t receive_max_length, uint8_t * send_buffer) {
+    buffer = receive_buffer;
+    max_length = receive_max_length;
+    tx_buffer = send_buffer;
+    length = tx_length = 0;
+#ifdef TPM_USE_METRICS
+    overrun = false;
+    metrics.frames = metrics.crc_errors = metrics.overruns = 0;
+#endif
+#ifdef TPM_USE_COMPRESSION
+    peer_compression = false;
+#endif
+    resetReceiver();
+    setState(TPM_RECEIVING);
+}
+
+void Framer::resetReceiver() {
+    index = crc = crc1 = crc2 = 0;
     escape = false;
+#ifdef TPM_USE_COMPRESSION
+    held = run = token = 0;
+    error = false;
+    compressed = false;
+#endif
+}
+
+void Framer::setState(bool value) {
+    state = value;
+    tx_index = tx_crc = 0;
+    tx_escape = false;
+    if(!isFullDuplex())
+        resetReceiver();
+#ifdef TPM_USE_COMPRESSION
+    tx_run = tx_token = 0;
+    tx_phase = TPM_PHASE_MARKER;
+    // Responses are compressed only if the request was, and only if it pays off
+    tx_compressed = value == TPM_SENDING && peer_compression && getCompressedLength() + 1 < tx_length;
+#endif
 }
 
 bool Framer::putReceivedByte(uint8_t value) {
     bool valid_frame = false;
-    if(state == TPM_RECEIVING) {
+    bool complete;
+    if(state == TPM_RECEIVING || isFullDuplex()) {
         if(value == 0x7E) {
-            valid_frame = index > 2 && crc2 == (buffer[index - 2] << 8 | buffer[index - 1]);
-            length = index - 2;
-            setState(TPM_RECEIVING);
+#ifdef TPM_USE_COMPRESSION
+            if(compressed) {
+                complete = held == 2;
+                valid_frame = complete && !error && !run && !token && crc2 == (hold[0] << 8 | hold[1]);
+                length = index;
+            }
+            else
+#endif
+            {
+                complete = index > 2;
+                valid_frame = complete && crc2 == (buffer[index - 2] << 8 | buffer[index - 1]);
+                length = index - 2;
+            }
+#ifdef TPM_USE_METRICS
+            if(valid_frame)
+                metrics.frames++;
+            else if(complete && !overrun)
+                metrics.crc_errors++;
+            if(overrun)
+                metrics.overruns++;
+            overrun = false;
+#endif
+#ifdef TPM_USE_COMPRESSION
+            if(valid_frame)
+                peer_compression = compressed;
+#endif
+            resetReceiver();
         }
         else if(value == 0x7D)
             escape = true;
@@ -116,8 +279,26 @@ bool Framer::putReceivedByte(uint8_t value) {
             crc2 = crc1;
             crc1 = crc;
             crc16(crc, value);
+#ifdef TPM_USE_COMPRESSION
+            // The last two bytes are held back until the end of the frame as they can be the CRC
+            if(compressed) {
+                if(held == 2)
+                    putCompressedByte(hold[0]);
+                else
+                    held++;
+                hold[0] = hold[1];
+                hold[1] = value;
+            }
+            else if(index == 0 && value == TPM_COMPRESSED_FRAME)
+                compressed = true;
+            else
+#endif
             if(index < max_length)
                 buffer[index++] = value;
+#ifdef TPM_USE_METRICS
+            else
+                overrun = true;
+#endif
         }
     }
     return valid_frame;
@@ -125,29 +306,171 @@ bool Framer::putReceivedByte(uint8_t value) {
 
 uint8_t Framer::getByteToSend() {
     if(state == TPM_SENDING) {
-        if(index == length + 2) {
+#ifdef TPM_USE_COMPRESSION
+        if(tx_compressed) {
+            if(tx_escape) {
+                tx_escape = false;
+                return tx_pending ^ 0x20;
+            }
+            else if(tx_phase == TPM_PHASE_DONE) {
+                setState(TPM_RECEIVING);
+                return 0x7E;
+            }
+            tx_pending = getCompressedByte();
+            if(tx_pending == 0x7E || tx_pending == 0x7D) {
+                tx_escape = true;
+                return 0x7D;
+            }
+            else
+                return tx_pending;
+        }
+#endif
+        if(tx_index == tx_length + 2) {
                 setState(TPM_RECEIVING);
                 return 0x7E;
         }
-        else if(index == length) {
-                buffer[index] = crc >> 8;
-                buffer[index + 1] = crc & 0xFF;
+        else if(tx_index == tx_length) {
+                tx_buffer[tx_index] = tx_crc >> 8;
+                tx_buffer[tx_index + 1] = tx_crc & 0xFF;
         }
         
-        if(escape) {
-            escape = false;
-            crc16(crc, buffer[index]);
-            return buffer[index++] ^ 0x20;
+        if(tx_escape) {
+            tx_escape = false;
+            crc16(tx_crc, tx_buffer[tx_index]);
+            return tx_buffer[tx_index++] ^ 0x20;
         }
-        else if(buffer[index] == 0x7E || buffer[index] == 0x7D) {
-            escape = true;
+        else if(tx_buffer[tx_index] == 0x7E || tx_buffer[tx_index] == 0x7D) {
+            tx_escape = true;
             return 0x7D;
         }
         else {
-            crc16(crc, buffer[index]);
-            return buffer[index++];
+            crc16(tx_crc, tx_buffer[tx_index]);
+            return tx_buffer[tx_index++];
         }
     }
     else
         return 0x7E;
 };
+
+#ifdef TPM_USE_COMPRESSION
+// Compressed frames start with TPM_COMPRESSED_FRAME followed by tokens:
+//   0lllllll                   literal run of l + 1 bytes, which follow
+//   1mmmmddd dddddddd          copy m + 3 bytes from d + 1 bytes back
+// The pack buffers are the compression window, so no extra memory is needed.
+
+uint8_t Framer::findMatch(tp_length_t position, tp_length_t * distance) {
+    tp_length_t candidate = position > TPM_COMPRESSION_WINDOW ? position - TPM_COMPRESSION_WINDOW : 0;
+    uint8_t best = 0;
+    uint8_t size;
+
+    for(; candidate != position; candidate++) {
+        for(size = 0; size != TPM_MAX_MATCH && position + size != tx_length && \
+            tx_buffer[candidate + size] == tx_buffer[position + size]; size++);
+        if(size >= best && size >= TPM_MIN_MATCH) {
+            best = size;
+            *distance = position - candidate;
+        }
+    }
+    return best;
+}
+
+uint8_t Framer::findLiterals(tp_length_t position) {
+    tp_length_t distance;
+    uint8_t count = 1;
+
+    while(count != TPM_MAX_LITERALS && position + count != tx_length && !findMatch(position + count, &distance))
+        count++;
+    return count;
+}
+
+tp_length_t Framer::getCompressedLength() {
+    tp_length_t position = 0;
+    tp_length_t compressed_length = 0;
+    tp_length_t distance;
+    uint8_t size;
+
+    while(position < tx_length && compressed_length < tx_length) {
+        if((size = findMatch(position, &distance)))
+            compressed_length += 2;
+        else {
+            size = findLiterals(position);
+            compressed_length += 1 + size;
+        }
+        position += size;
+    }
+    return compressed_length;
+}
+
+uint8_t Framer::getCompressedByte() {
+    tp_length_t distance;
+    uint8_t value;
+
+    if(tx_phase == TPM_PHASE_MARKER) {
+        tx_phase = TPM_PHASE_TOKENS;
+        value = TPM_COMPRESSED_FRAME;
+    }
+    else if(tx_phase == TPM_PHASE_MATCH) {
+        tx_phase = TPM_PHASE_TOKENS;
+        tx_index += tx_match;
+        value = tx_token;
+    }
+    else if(tx_run) {
+        tx_run--;
+        value = tx_buffer[tx_index++];
+    }
+    else if(tx_index != tx_length) {
+        if((tx_match = findMatch(tx_index, &distance))) {
+            distance -= 1;
+            tx_phase = TPM_PHASE_MATCH;
+            tx_token = distance & 0xFF;
+            value = 0x80 | (tx_match - TPM_MIN_MATCH) << 3 | distance >> 8;
+        }
+        else {
+            tx_run = findLiterals(tx_index);
+            value = tx_run - 1;
+        }
+    }
+    else if(tx_phase == TPM_PHASE_TOKENS) {
+        tx_phase = TPM_PHASE_CRC;
+        tx_token = tx_crc & 0xFF;
+        return tx_crc >> 8;
+    }
+    else {
+        tx_phase = TPM_PHASE_DONE;
+        return tx_token;
+    }
+    crc16(tx_crc, value);
+    return value;
+}
+
+void Framer::putCompressedByte(uint8_t value) {
+    tp_length_t distance;
+    uint8_t size;
+
+    if(run) {
+        run--;
+        if(index < max_length)
+            buffer[index++] = value;
+        else
+            error = true;
+    }
+    else if(token) {
+        size = ((token >> 3) & 0x0F) + TPM_MIN_MATCH;
+        distance = ((token & 0x07) << 8 | value) + 1;
+        token = 0;
+        if(distance > index || index + size > max_length)
+            error = true;
+        else
+            for(; size; size--, index++)
+                buffer[index] = buffer[index - distance];
+    }
+    else if(value & 0x80)
+        token = value;
+    else
+        run = value + 1;
+#ifdef TPM_USE_METRICS
+    if(error && index == max_length)
+        overrun = true;
+#endif
+}
+#endif
@@ -26,13 +26,30 @@
 #define TPM_MAX_RESOURCES 4
 #define TPM_MAX_PATH_LENGTH 16
 
+#ifdef TPM_USE_METRICS
+#define TPM_METRICS_PATH "$metrics"
+#define TPM_METRICS_BUCKETS 8       // handler times below 16, 64, 256... clock units
+
+#ifndef TPM_CLOCK
+#ifdef ARDUINO
+#include <Arduino.h>
+#define TPM_CLOCK() micros()
+#else
+#include <time.h>
+#define TPM_CLOCK() ((uint32_t) clock())
+#endif
+#endif
+#endif
+
 #define TPM_GET    0x01
 #define TPM_POST   0x02
 #define TPM_PUT    0x03
 #define TPM_DELETE 0x04
+#define TPM_CONDITIONAL 0x10
 
 #define TPM_201_Created            0x21
 #define TPM_202_Deleted            0x22
+#define TPM_203_Valid              0x23
 #define TPM_204_Changed            0x24
 #define TPM_205_Content            0x25
 #define TPM_400_Bad_Request        0x40
@@ -45,6 +62,26 @@
 #define TPM_RECEIVING 0
 #define TPM_SENDING 1
 
+#ifdef TPM_USE_COMPRESSION
+#define TPM_COMPRESSED_FRAME 0x3F   // an extended size boolean, never found in a valid pack
+#ifndef TPM_COMPRESSION_WINDOW
+#define TPM_COMPRESSION_WINDOW 256
+#endif
+#define TPM_MAX_DISTANCE 2048       // 11 bits in the match tokens
+#if TPM_COMPRESSION_WINDOW > TPM_MAX_DISTANCE
+#error "TPM_COMPRESSION_WINDOW cannot be greater than 2048."
+#endif
+#define TPM_MIN_MATCH 3
+#define TPM_MAX_MATCH 18
+#define TPM_MAX_LITERALS 128
+
+#define TPM_PHASE_MARKER 0
+#define TPM_PHASE_TOKENS 1
+#define TPM_PHASE_MATCH  2
+#define TPM_PHASE_CRC    3
+#define TPM_PHASE_DONE   4
+#endif
+
 #define crc16(crc_value, byte_value)					\
     crc_value  = (unsigned char)(crc_value >> 8) | (crc_value << 8);	\
     crc_value ^= (byte_value);						\
@@ -65,8 +102,11 @@ class Resource {
         virtual uint8_t post(Request &request) { return TPM_405_Method_Not_Allowed; };
         virtual uint8_t put(Request &request) { return TPM_405_Method_Not_Allowed; };
         virtual uint8_t del(Request &request) { return TPM_405_Method_Not_Allowed; };
+        virtual tp_integer_t revision(Request &request) { return 0; };
 };
 
+class Framer;
+
 class Postman {
     public:
         Request request;
@@ -74,12 +114,28 @@ class Postman {
             const char *path;
             Resource * resource;
             // bool subpaths;
+#ifdef TPM_USE_METRICS
+            uint32_t max_time;
+            uint16_t histogram[TPM_METRICS_BUCKETS];
+#endif
         } resources[TPM_MAX_RESOURCES];
         uint8_t registered_resources;
+#ifdef TPM_USE_METRICS
+        uint16_t requests;
+        uint16_t client_errors;
+        Framer * framer;
+
+        void setFramer(Framer &request_framer) { framer = &request_framer; };
+        bool putMetrics();
+#endif
 
         Postman();
         bool registerResource(const char * path, Resource &resource);
+#ifdef TP_USE_DICTIONARY
+        void setDictionary(const char * const * strings, uint16_t count);
+#endif
         tp_length_t handlePack(uint8_t * buffer, tp_length_t length, tp_length_t max_length);
+        tp_length_t handlePack(uint8_t * request_buffer, tp_length_t length, uint8_t * response_buffer, tp_length_t max_length);
 };
 
 
@@ -94,14 +150,55 @@ class Framer {
         tp_length_t    max_length;
         tp_length_t    index;
         uint8_t  *  buffer;
+        bool        tx_escape;
+        uint16_t    tx_crc;
+        tp_length_t tx_length;
+        tp_length_t tx_index;
+        uint8_t  *  tx_buffer;
+#ifdef TPM_USE_METRICS
+        bool        overrun;
+#endif
+#ifdef TPM_USE_COMPRESSION
+        bool        compressed;
+        bool        peer_compression;
+        bool        error;
+        uint8_t     held;
+        uint8_t     hold[2];
+        uint8_t     run;
+        uint8_t     token;
+        bool        tx_compressed;
+        uint8_t     tx_phase;
+        uint8_t     tx_run;
+        uint8_t     tx_token;
+        uint8_t     tx_match;
+        uint8_t     tx_pending;
+
+        uint8_t findMatch(tp_length_t position, tp_length_t * distance);
+        uint8_t findLiterals(tp_length_t position);
+        tp_length_t getCompressedLength();
+        uint8_t getCompressedByte();
+        void putCompressedByte(uint8_t value);
+#endif
+        void resetReceiver();
     public:
+#ifdef TPM_USE_METRICS
+        struct {
+            uint16_t frames;
+            uint16_t crc_errors;
+            uint16_t overruns;
+        } metrics;
+#endif
         Framer(uint8_t * pack_buffer, tp_length_t pack_max_length);
+        Framer(uint8_t * receive_buffer, tp_length_t receive_max_length, uint8_t * send_buffer);
         bool putReceivedByte(uint8_t value);
         uint8_t getByteToSend();
         tp_length_t getLength() { return length; };
-        void setLength(tp_length_t value) { length = value; };
+        void setLength(tp_length_t value) { length = tx_length = value; };
+        // With separate buffers, sets the length to send without touching the received one
+        void setSendLength(tp_length_t value) { tx_length = value; };
         bool getState() { return state; };
-        void setState(bool value) { state = value; index = crc = crc1 = crc2 = 0; };
+        void setState(bool value);
+        bool isFullDuplex() { return tx_buffer != buffer; };
 };
 
 #endif
@@ -0,0 +1,121 @@
+#include <TinyPacks.h>
+
+// Compares sending every telemetry sample in full against sending only the
+// delta from the previous sample. The samples replay a short recorded trace
+// of a sensor node that reports once per second.
+
+#define TRACE_LENGTH 16
+int16_t trace_temperature[TRACE_LENGTH] = { 215, 215, 215, 216, 216, 216, 216, 217, 217, 217, 217, 217, 218, 218, 217, 217 };
+int16_t trace_rssi[TRACE_LENGTH] = { -61, -61, -62, -61, -60, -61, -61, -61, -63, -62, -61, -61, -61, -60, -61, -61 };
+bool    trace_door[TRACE_LENGTH] = { 0, 0, 0, 0, 0, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+// Set to 1 to also print every baseline, delta and sample in hex, which
+// tinypacks-delta-check.py uses to check the Python decoder
+#define PRINT_DELTAS 0
+
+#define MAX_PACKED_DATA 128
+uint8_t baseline[MAX_PACKED_DATA];
+uint8_t sample[MAX_PACKED_DATA];
+uint8_t delta[MAX_PACKED_DATA];
+uint8_t rebuilt[MAX_PACKED_DATA];
+
+PackWriter writer;
+
+tp_length_t packSample(uint8_t * buffer, uint32_t uptime, uint8_t step)
+{
+  writer.setBuffer(buffer, MAX_PACKED_DATA);
+  writer.openMap();
+  writer.putString("node");
+  writer.putString("greenhouse-2");
+  writer.putString("firmware");
+  writer.putInteger(10203);
+  writer.putString("uptime");
+  writer.putInteger(uptime);
+  writer.putString("temperature");
+  writer.putReal(trace_temperature[step] / 10.0);
+  writer.putString("humidity");
+  writer.putInteger(48);
+  writer.putString("door");
+  writer.putBoolean(trace_door[step]);
+  writer.putString("radio");
+  writer.openMap();
+  writer.putString("rssi");
+  writer.putInteger(trace_rssi[step]);
+  writer.putString("channel");
+  writer.putInteger(11);
+  writer.close();
+  writer.close();
+  return writer.getOffset();
+}
+
+void printHex(uint8_t * buffer, tp_length_t length)
+{
+  for(tp_length_t i = 0; i != length; i++) {
+    if(buffer[i] < 0x10)
+      Serial.print('0');
+    Serial.print(buffer[i], HEX);
+  }
+}
+
+void setup()
+{
+  Serial.begin(9600);
+}
+
+void loop()
+{
+  uint32_t full_bytes = 0, delta_bytes = 0;
+  uint32_t encode_time = 0, apply_time = 0, start;
+  tp_length_t baseline_length, sample_length, delta_length, rebuilt_length;
+  uint8_t errors = 0;
+  uint8_t step;
+
+  baseline_length = packSample(baseline, 0, 0);
+  for(step = 1; step != TRACE_LENGTH; step++) {
+    sample_length = packSample(sample, step, step);
+
+    start = micros();
+    delta_length = PackDelta::encode(baseline, baseline_length, sample, sample_length, delta, MAX_PACKED_DATA);
+    encode_time += micros() - start;
+
+    start = micros();
+    rebuilt_length = PackDelta::rebuild(baseline, baseline_length, delta, delta_length, rebuilt, MAX_PACKED_DATA);
+    apply_time += micros() - start;
+
+    if(delta_length == TP_INVALID_LENGTH || rebuilt_length != sample_length || memcmp(rebuilt, sample, sample_length))
+      errors++;
+#if PRINT_DELTAS
+    printHex(baseline, baseline_length);
+    Serial.print(' ');
+    printHex(delta, delta_length);
+    Serial.print(' ');
+    printHex(sample, sample_length);
+    Serial.println();
+#endif
+    full_bytes += sample_length;
+    delta_bytes += delta_length;
+
+    memcpy(baseline, sample, sample_length);
+    baseline_length = sample_length;
+  }
+
+  Serial.println("Delta benchmark:");
+  Serial.print("  samples: ");
+  Serial.println(TRACE_LENGTH - 1);
+  Serial.print("  full bytes: ");
+  Serial.println(full_bytes);
+  Serial.print("  delta bytes: ");
+  Serial.println(delta_bytes);
+  Serial.print("  saved: ");
+  Serial.print(100 - delta_bytes * 100 / full_bytes);
+  Serial.println("%");
+  Serial.print("  encode us/sample: ");
+  Serial.println(encode_time / (TRACE_LENGTH - 1));
+  Serial.print("  rebuild us/sample: ");
+  Serial.println(apply_time / (TRACE_LENGTH - 1));
+  Serial.print("  errors: ");
+  Serial.println(errors);
+  Serial.println();
+
+  delay(5000);
+}
@@ -0,0 +1,44 @@
+#!/usr/bin/python
+#
+# TinyPacks delta decoder check
+#
+# Reads the lines printed by the tinypacks_delta_benchmark example built with
+# PRINT_DELTAS set to 1, each one a baseline, a delta and the encoded sample
+# in hex, and checks that tinypacks.apply_delta() rebuilds every sample byte
+# for byte. The lines are read from the file or serial port given, or from
+# the standard input.
+#
+
+import sys
+import binascii
+import tinypacks
+
+if len(sys.argv) > 1 and sys.argv[1].startswith("/dev/"):
+    import serial
+    lines = serial.Serial(sys.argv[1], 9600, timeout=10)
+elif len(sys.argv) > 1:
+    lines = open(sys.argv[1])
+else:
+    lines = sys.stdin
+
+checked = 0
+errors = 0
+for line in lines:
+    fields = line.split()
+    if len(fields) != 3:
+        if checked and line.startswith("Delta benchmark"):
+            break
+        continue
+    baseline, delta, sample = [binascii.unhexlify(field) for field in fields]
+    try:
+        rebuilt = tinypacks.apply_delta(baseline, delta)
+    except ValueError as err:
+        rebuilt = None
+        print("Delta %i failed: %s" % (checked, err))
+    if rebuilt != sample:
+        errors += 1
+        print("Delta %i mismatch: %s" % (checked, binascii.hexlify(rebuilt or "")))
+    checked += 1
+
+print("%i deltas checked, %i errors" % (checked, errors))
+sys.exit(1 if errors or not checked else 0)
@@ -43,13 +43,17 @@ TP_NUMBER       = 0b01000000
 TP_BLOCK        = 0b10000000
 TP_CONTAINER    = 0b11000000
 
+TP_REFERENCE_8   = TP_NONE | 1
+TP_REFERENCE_16  = TP_NONE | 2
+TP_MAX_REFERENCE = 0xFFFF
+
 
 def bit_len(n):
     s = bin(n)       # binary representation:  bin(-37) --> '-0b100101'
     s = s.lstrip('-0b') # remove leading zeros and minus sign
     return len(s)       # len('100101') --> 6
 
-def pack(obj, use_double=False):
+def pack(obj, use_double=False, dictionary=None):
     if obj is None:
         return chr(TP_NONE)
     elif isinstance(obj, bool):
@@ -78,6 +82,12 @@ def pack(obj, use_double=False):
                 return struct.pack(">Bf", TP_REAL|4, obj)
     elif isinstance(obj, (str, unicode)):
         content = obj.encode('utf_8') if isinstance(obj, unicode) else obj
+        if dictionary and content in dictionary:
+            reference = dictionary.index(content)
+            if reference <= 0xFF:
+                return struct.pack(">BB", TP_REFERENCE_8, reference)
+            elif reference < TP_MAX_REFERENCE:
+                return struct.pack(">BH", TP_REFERENCE_16, reference)
         byte_length = len(content)
         if byte_length <= TP_SMALL_SIZE_MAX:
             return struct.pack(">B%is" % byte_length, TP_STRING | byte_length, content)
@@ -98,7 +108,7 @@ def pack(obj, use_double=False):
         else:
             raise ValueError("Bytearray too long")
     elif isinstance(obj, (list, tuple)):
-        content = ''.join([pack(value) for value in obj])
+        content = ''.join([pack(value, dictionary=dictionary) for value in obj])
         byte_length = len(content)
         if byte_length <= TP_SMALL_SIZE_MAX:
             return struct.pack(">B%is" % byte_length, TP_LIST | byte_length, content)
@@ -111,8 +121,8 @@ def pack(obj, use_double=False):
     elif isinstance(obj, dict):
         elements = []
         for item in obj.items():
-            elements.append(pack(item[0]))
-            elements.append(pack(item[1]))
+            elements.append(pack(item[0], dictionary=dictionary))
+            elements.append(pack(item[1], dictionary=dictionary))
         content = ''.join(elements)
         byte_length = len(content)
         if byte_length <= TP_SMALL_SIZE_MAX:
@@ -125,9 +135,23 @@ def pack(obj, use_double=False):
             raise ValueError("Dict too long")
     else:
         raise ValueError("Unknown type")
+
+def pack_dictionary(dictionary):
+    if not dictionary or not all(dictionary):
+        raise ValueError("Dictionaries cannot be empty or hold empty strings")
+    content = pack(list(dictionary))
+    byte_length = len(content)
+    if byte_length <= TP_SMALL_SIZE_MAX:
+        return struct.pack(">B%is" % byte_length, TP_NONE | byte_length, content)
+    elif byte_length < 0xFFFF:
+        return struct.pack(">BH%is" % byte_length, TP_NONE|TP_EXTENDED_SIZE_16, byte_length, content)
+    elif byte_length < 0xFFFFFFFF:
+        return struct.pack(">BHL%is" % byte_length, TP_NONE|TP_EXTENDED_SIZE_16, TP_EXTENDED_SIZE_32, byte_length, content)
+    else:
+        raise ValueError("Dictionary too long")
         
 
-def unpack(bytes):
+def unpack(bytes, dictionary=None):
     if len(bytes) == 0:
         ValueError("Cannot unpack an empty pack")
     content_type = ord(bytes[0]) & TP_TYPE_MASK    
@@ -146,7 +170,24 @@ def unpack(bytes):
             content_raw = bytes[7 : element_length]
     
     if content_type == TP_NONE:
-        obj = None
+        if content_length == 0:
+            obj = None
+        elif content_length <= 2:
+            reference = struct.unpack(">B" if content_length == 1 else ">H", content_raw)[0]
+            if not dictionary or reference >= len(dictionary):
+                raise ValueError("Unknown dictionary reference")
+            obj = dictionary[reference]
+            obj = obj.decode("utf8") if isinstance(obj, str) else obj
+        else:
+            # A dictionary element replaces the contents of the list passed as
+            # dictionary, so it stays in effect for the following elements
+            entries = unpack(content_raw)[0]
+            if dictionary is None:
+                dictionary = []
+            dictionary[:] = entries
+            if len(bytes) > element_length:
+                return unpack(bytes[element_length:], dictionary)
+            obj = None
     elif content_type == TP_BOOLEAN:
         obj = True if (content_length and ord(content_raw[0])) else False 
     elif content_type == TP_INTEGER:
@@ -178,14 +219,86 @@ def unpack(bytes):
     elif content_type == TP_LIST:
         obj = []
         while(content_raw):
-            item, content_raw = unpack(content_raw)
+            item, content_raw = unpack(content_raw, dictionary)
             obj.append(item)
     elif content_type == TP_MAP:
         obj = {}
         while(content_raw):
-            key, content_raw = unpack(content_raw)
-            value, content_raw = unpack(content_raw)
+            key, content_raw = unpack(content_raw, dictionary)
+            value, content_raw = unpack(content_raw, dictionary)
             obj[key] = value
     
     return (obj, bytes[element_length:])
-    
\ No newline at end of file
+    
+
+def parse_header(bytes):
+    """Returns the header and content lengths of the element at the start of bytes."""
+    if len(bytes) == 0:
+        raise ValueError("Missing element")
+    content_length = ord(bytes[0]) & TP_SMALL_SIZE_MASK
+    if content_length != TP_EXTENDED_SIZE_16:
+        header_length = 1
+    elif len(bytes) >= 3 and struct.unpack(">BH", bytes[0:3])[1] != TP_EXTENDED_SIZE_32:
+        header_length, content_length = 3, struct.unpack(">BH", bytes[0:3])[1]
+    elif len(bytes) >= 7:
+        header_length, content_length = 7, struct.unpack(">BHL", bytes[0:7])[2]
+    else:
+        raise ValueError("Truncated element header")
+    if header_length + content_length > len(bytes):
+        raise ValueError("Truncated element")
+    return header_length, content_length
+
+def pack_header(element_type, content_length, width=1):
+    """Packs an element header at least width bytes long."""
+    if content_length <= TP_SMALL_SIZE_MAX and width <= 1:
+        return chr(element_type | content_length)
+    elif content_length < 0xFFFF and width <= 3:
+        return struct.pack(">BH", element_type | TP_EXTENDED_SIZE_16, content_length)
+    elif content_length < 0xFFFFFFFF:
+        return struct.pack(">BHL", element_type | TP_EXTENDED_SIZE_16, TP_EXTENDED_SIZE_32, content_length)
+    else:
+        raise ValueError("Element too long")
+
+def split_elements(bytes):
+    """Splits a sequence of packed elements without unpacking them."""
+    elements = []
+    while bytes:
+        header_length, content_length = parse_header(bytes)
+        elements.append(bytes[:header_length + content_length])
+        bytes = bytes[header_length + content_length:]
+    return elements
+
+def _replace_element(content, path, element):
+    elements = split_elements(content)
+    if path[0] >= len(elements):
+        raise ValueError("Delta patch out of range")
+    if len(path) > 1:
+        container = elements[path[0]]
+        if ord(container[0]) & TP_FAMILY_MASK != TP_CONTAINER:
+            raise ValueError("Delta patch goes into a non container element")
+        header_length, content_length = parse_header(container)
+        inner = _replace_element(container[header_length:], path[1:], element)
+        # Like the C++ PackEditor, headers keep their width unless it must grow
+        element = pack_header(ord(container[0]) & TP_TYPE_MASK, len(inner), header_length) + inner
+    elements[path[0]] = element
+    return ''.join(elements)
+
+def apply_delta(baseline, delta):
+    """Rebuilds a pack from the pack it was encoded against and a delta
+    written by the C++ PackDelta::encode(). The result is the same the C++
+    PackDelta::rebuild() gives, byte for byte."""
+    elements = split_elements(delta)
+    if len(elements) != 1 or ord(elements[0][0]) & TP_TYPE_MASK != TP_LIST:
+        raise ValueError("A delta must be a single list")
+    header_length, content_length = parse_header(elements[0])
+    pack = baseline
+    for patch in split_elements(elements[0][header_length:]):
+        header_length, content_length = parse_header(patch)
+        patch_elements = split_elements(patch[header_length:])
+        if ord(patch[0]) & TP_TYPE_MASK != TP_LIST or len(patch_elements) < 2:
+            raise ValueError("Malformed delta patch")
+        path = [unpack(index)[0] for index in patch_elements[:-1]]
+        if not all(isinstance(index, (int, long)) and index >= 0 for index in path):
+            raise ValueError("Malformed delta patch")
+        pack = _replace_element(pack, path, patch_elements[-1])
+    return pack
@@ -0,0 +1,62 @@
+#!/usr/bin/python
+#
+# TinyPostman frame compression benchmark
+#
+# Measures the compression ratio and the host side latency of the frame
+# compression on a corpus of packets. Every file given is a packet, either
+# raw TinyPacks data or JSON if its name ends with .json. Without files a
+# small built-in corpus is used.
+#
+
+import sys
+import time
+import json
+import tinypacks
+from tinypostman.compression import *
+
+if len(sys.argv) > 1:
+    corpus = []
+    for name in sys.argv[1:]:
+        data = open(name, "rb").read()
+        corpus.append((name, tinypacks.pack(json.loads(data)) if name.endswith(".json") else data))
+else:
+    corpus = [
+        ("index", tinypacks.pack(["led", "temperature", "humidity", "config"])),
+        ("led", tinypacks.pack({"pin": 13, "state": True})),
+        ("readings", tinypacks.pack([{"temperature": 21.5 + i / 10.0, "humidity": 40 + i % 3} for i in range(8)])),
+        ("config", tinypacks.pack({"name": "greenhouse-2", "period": 1000, "alarms": {"low": 5.0, "high": 35.0},
+                                   "channels": [{"name": "channel-%i" % i, "enabled": True, "gain": 1} for i in range(4)]})),
+    ]
+
+REPEAT = 200
+total_raw = 0
+total_compressed = 0
+total_compress_time = 0.0
+total_decompress_time = 0.0
+
+print("%-24s %8s %8s %7s %10s %10s" % ("packet", "bytes", "comp.", "ratio", "comp. us", "decomp. us"))
+for name, data in corpus:
+    start = time.time()
+    for i in range(REPEAT):
+        compressed = compress(data)
+    compress_time = (time.time() - start) / REPEAT
+    start = time.time()
+    for i in range(REPEAT):
+        decompressed = decompress(compressed)
+    decompress_time = (time.time() - start) / REPEAT
+    if decompressed != data:
+        print("%s: round trip failed" % name)
+        sys.exit(1)
+    framed = min(len(compressed) + 1, len(data))     # the Framer sends the smaller one
+    print("%-24s %8i %8i %6.1f%% %10.1f %10.1f" % (name[-24:], len(data), framed, 100.0 * framed / len(data),
+                                                 compress_time * 1e6, decompress_time * 1e6))
+    total_raw += len(data)
+    total_compressed += framed
+    total_compress_time += compress_time
+    total_decompress_time += decompress_time
+
+print("%-24s %8i %8i %6.1f%% %10.1f %10.1f" % ("total", total_raw, total_compressed, 100.0 * total_compressed / total_raw,
+                                             total_compress_time * 1e6, total_decompress_time * 1e6))
+print("Host throughput: %.0f KB/s compressing, %.0f KB/s decompressing" % (total_raw / total_compress_time / 1024,
+                                                                         total_raw / total_decompress_time / 1024))
+print("Time on a 9600 baud link: %.1f ms raw, %.1f ms compressed" % (total_raw * 10000.0 / 9600, total_compressed * 10000.0 / 9600))
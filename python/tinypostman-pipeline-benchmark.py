@@ -0,0 +1,44 @@
+#!/usr/bin/python
+#
+# TinyPostman pipelining benchmark
+#
+# Compares the request rate of sequential GETs against pipelined GETs, which
+# keep the next request on the link while the previous response is being
+# received. Pipelining needs a device built with a full duplex Framer.
+#
+
+import sys
+import time
+from tinypostman import *
+
+if len(sys.argv) < 2:
+    print("\nUsage: %s <serial port> [resource] [count]\n" % sys.argv[0])
+    sys.exit()
+
+resource = sys.argv[2] if len(sys.argv) > 2 else ""
+count = int(sys.argv[3]) if len(sys.argv) > 3 else 50
+
+pm = Postman(sys.argv[1])
+time.sleep(1.5)     # workaround for Arduino bootloader bug that eats the first bytes after opening the port
+
+try:
+    start = time.time()
+    for i in range(count):
+        response = pm.get(resource)
+        if response[0] != TPM_205_Content:
+            raise PostmanError(TPM_RESPONSE_TEXT.get(response[0], str(response[0])))
+    sequential = time.time() - start
+
+    start = time.time()
+    responses = pm.pipeline([(TPM_GET, resource, None)] * count)
+    pipelined = time.time() - start
+    for response in responses:
+        if response[0] != TPM_205_Content:
+            raise PostmanError(TPM_RESPONSE_TEXT.get(response[0], str(response[0])))
+except PostmanError as err:
+    print("Benchmark failed: %s" % err)
+    sys.exit(1)
+
+print("%i GETs of '%s':" % (count, resource))
+print("  sequential: %.2f s, %.1f requests/s" % (sequential, count / sequential))
+print("  pipelined:  %.2f s, %.1f requests/s" % (pipelined, count / pipelined))
@@ -0,0 +1,103 @@
+#!/usr/bin/python
+#
+#  TinyPostman - Copyright (c) 2012 Francisco Castro <http://fran.cc>
+#
+#  Permission is hereby granted, free of charge, to any person obtaining a
+#  copy of this software and associated documentation files (the "Software"),
+#  to deal in the Software without restriction, including without limitation
+#  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+#  and/or sell copies of the Software, and to permit persons to whom the
+#  Software is furnished to do so, subject to the following conditions:
+#
+#  The above copyright notice and this permission notice shall be included in
+#  all copies or substantial portions of the Software.
+# 
+#  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+#  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+#  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+#  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+#  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+#  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+#  DEALINGS IN THE SOFTWARE.
+
+
+# Compressed frames start with TPM_COMPRESSED_FRAME followed by tokens:
+#   0lllllll                   literal run of l + 1 bytes, which follow
+#   1mmmmddd dddddddd          copy m + 3 bytes from d + 1 bytes back
+
+TPM_COMPRESSED_FRAME = "\x3F"
+TPM_COMPRESSION_WINDOW = 256
+TPM_MIN_MATCH = 3
+TPM_MAX_MATCH = 18
+TPM_MAX_LITERALS = 128
+TPM_MAX_DISTANCE = 2048
+
+def compress(data, window=TPM_COMPRESSION_WINDOW):
+    window = min(window, TPM_MAX_DISTANCE)
+    tokens = []
+    literals = []
+    chains = {}
+    length = len(data)
+    position = 0
+    while position < length:
+        best_size = 0
+        best_distance = 0
+        chain = chains.get(data[position:position + TPM_MIN_MATCH], [])
+        for candidate in reversed(chain):
+            if position - candidate > window:
+                break
+            size = TPM_MIN_MATCH
+            while size < TPM_MAX_MATCH and position + size < length and data[candidate + size] == data[position + size]:
+                size += 1
+            if size > best_size:
+                best_size, best_distance = size, position - candidate
+                if size == TPM_MAX_MATCH:
+                    break
+        if position + TPM_MIN_MATCH > length:
+            best_size = 0
+
+        if best_size:
+            if literals:
+                tokens.append(chr(len(literals) - 1) + "".join(literals))
+                literals = []
+            distance = best_distance - 1
+            tokens.append(chr(0x80 | (best_size - TPM_MIN_MATCH) << 3 | distance >> 8) + chr(distance & 0xFF))
+            step = best_size
+        else:
+            literals.append(data[position])
+            if len(literals) == TPM_MAX_LITERALS:
+                tokens.append(chr(len(literals) - 1) + "".join(literals))
+                literals = []
+            step = 1
+
+        for index in range(position, min(position + step, length - TPM_MIN_MATCH + 1)):
+            chains.setdefault(data[index:index + TPM_MIN_MATCH], []).append(index)
+        position += step
+
+    if literals:
+        tokens.append(chr(len(literals) - 1) + "".join(literals))
+    return "".join(tokens)
+
+def decompress(data):
+    output = bytearray()
+    position = 0
+    while position < len(data):
+        token = ord(data[position])
+        position += 1
+        if token & 0x80:
+            if position >= len(data):
+                raise ValueError("Truncated match")
+            size = ((token >> 3) & 0x0F) + TPM_MIN_MATCH
+            distance = ((token & 0x07) << 8 | ord(data[position])) + 1
+            position += 1
+            if distance > len(output):
+                raise ValueError("Match distance out of range")
+            for i in range(size):
+                output.append(output[-distance])
+        else:
+            size = token + 1
+            if position + size > len(data):
+                raise ValueError("Truncated literals")
+            output.extend(data[position:position + size])
+            position += size
+    return str(output)
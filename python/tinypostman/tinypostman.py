@@ -20,19 +20,23 @@
 #  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
 #  DEALINGS IN THE SOFTWARE.
 
+import copy
 import time
 import crc16
 import struct
 import serial
 import tinypacks
+from compression import *
 
 TPM_GET    = 0x01
 TPM_POST   = 0x02
 TPM_PUT    = 0x03
 TPM_DELETE = 0x04
+TPM_CONDITIONAL = 0x10
 
 TPM_201_Created            = 0x21
 TPM_202_Deleted            = 0x22
+TPM_203_Valid              = 0x23
 TPM_204_Changed            = 0x24
 TPM_205_Content            = 0x25
 TPM_400_Bad_Request        = 0x40
@@ -45,6 +49,7 @@ TPM_413_Request_Entity_Too_Large     = 0x4D
 TPM_RESPONSE_TEXT = {
     0x21: "201 Created",
     0x22: "202 Deleted",
+    0x23: "203 Valid",
     0x24: "204 Changed",
     0x25: "205 Content",
     0x40: "400 Bad Request",
@@ -59,19 +64,27 @@ class PostmanError(IOError):
     pass
     
 class Postman:
-    def __init__(self, device, timeout=4):
+    def __init__(self, device, timeout=4, dictionary=None, compression=False, cache_max_age=None):
         self.debug = False
         self.token = 0
+        self.dictionary = dictionary
+        self.compression = compression
+        self.cache_max_age = cache_max_age
+        self.cache = {}     # path -> [revision, payload, validation time]
         try:
             self.fd = serial.Serial(device, 9600, stopbits=serial.STOPBITS_ONE, parity=serial.PARITY_NONE, timeout=timeout)
         except IOError as err:
             raise PostmanError("Failed to open port: %s" % err)
 
-    def send(self, method, token, path, has_payload=False, payload=None):
+    def send(self, method, token, path, has_payload=False, payload=None, revision=None):
+        frame = "%s%s%s" % (tinypacks.pack(method), tinypacks.pack(token), tinypacks.pack(path, dictionary=self.dictionary))
+        if revision is not None:
+            frame += tinypacks.pack(revision)
         if has_payload:
-            frame = "%s%s%s%s" % (tinypacks.pack(method), tinypacks.pack(token), tinypacks.pack(path), tinypacks.pack(payload))
-        else:
-            frame = "%s%s%s" % (tinypacks.pack(method), tinypacks.pack(token), tinypacks.pack(path))
+            frame += tinypacks.pack(payload, dictionary=self.dictionary)
+        if self.compression:
+            # Always, even when it does not pay off, as it tells the device that it can reply compressed
+            frame = TPM_COMPRESSED_FRAME + compress(frame)
         frame +=  struct.pack(">H", crc16.crc16str(frame))
 
         if self.debug:
@@ -124,20 +137,23 @@ class Postman:
 
         if len(frame) >= 4 and crc16.crc16str(frame[:-2]) == struct.unpack(">H", frame[-2:])[0]:
             frame = frame[:-2]
-            response, frame = tinypacks.unpack(frame)
-            if frame:
-                token, frame = tinypacks.unpack(frame)
-                if frame:
-                    payload, frame = tinypacks.unpack(frame)
-                    return [response, token, payload]
-                else:
-                    return [response, token]
-            else:
-                return [response]
+            if frame[:1] == TPM_COMPRESSED_FRAME:
+                try:
+                    frame = decompress(frame[1:])
+                except ValueError as err:
+                    raise PostmanError("Frame decompression failed: %s" % err)
+            dictionary = list(self.dictionary or [])   # a dictionary sent in the frame lasts only for that frame
+            elements = []
+            while frame:
+                element, frame = tinypacks.unpack(frame, dictionary)
+                elements.append(element)
+            return elements
         else:
             raise PostmanError("Frame receiving failed, bad CRC %s != %s " % (hex(crc16.crc16str(frame[:-2])), hex(struct.unpack(">H", frame[-2:])[0])))
 
     def get(self, path, query=None):
+        if self.cache_max_age is not None and query is None:
+            return self.get_cached(path)
         self.send(TPM_GET, self.token, path, query is not None, query)
         response = self.receive()
         if len(response) > 1 and response[1] != self.token: 
@@ -145,7 +161,35 @@ class Postman:
         self.token = (self.token + 1) & 0x7F
         return response[0:1] + response[2:]
 
+    def get_cached(self, path):
+        """Returns the cached content of path while it is younger than
+        cache_max_age seconds, otherwise revalidates it with a conditional
+        GET. Only resources that report a revision are cached."""
+        entry = self.cache.get(path)
+        now = time.time()
+        if entry and now - entry[2] < self.cache_max_age:
+            return [TPM_205_Content, copy.deepcopy(entry[1])]
+        self.send(TPM_GET | TPM_CONDITIONAL, self.token, path, revision=entry[0] if entry else 0)
+        response = self.receive()
+        if len(response) > 1 and response[1] != self.token: 
+            raise PostmanError("Response token does not match request token.")
+        self.token = (self.token + 1) & 0x7F
+        if response[0] == TPM_203_Valid and entry:
+            entry[2] = now
+            return [TPM_205_Content, copy.deepcopy(entry[1])]
+        if response[0] == TPM_205_Content and len(response) > 2:
+            revision, response = response[-1], response[0:1] + response[2:-1]   # the revision always comes last
+            if revision and len(response) > 1:
+                # Kept as received, packing it again could change it, e.g. doubles into floats
+                self.cache[path] = [revision, copy.deepcopy(response[1]), now]
+            else:
+                self.cache.pop(path, None)
+            return response
+        self.cache.pop(path, None)
+        return response[0:1] + response[2:]
+
     def put(self, path, data=None):
+        self.cache.pop(path, None)
         self.send(TPM_PUT, self.token, path, data is not None, data)
         response = self.receive()
         if len(response) > 1 and response[1] != self.token: 
@@ -154,6 +198,7 @@ class Postman:
         return response[0:1] + response[2:]
 
     def post(self, path, data=None):
+        self.cache.pop(path, None)
         self.send(TPM_POST, self.token, path, data is not None, data)
         response = self.receive()
         if len(response) > 1 and response[1] != self.token: 
@@ -162,9 +207,34 @@ class Postman:
         return response[0:1] + response[2:]
 
     def delete(self, path, query=None):
+        self.cache.pop(path, None)
         self.send(TPM_DELETE, self.token, path, query is not None, query)
         response = self.receive()
         if len(response) > 1 and response[1] != self.token: 
             raise PostmanError("Response token does not match request token.")
         self.token = (self.token + 1) & 0x7F
         return response[0:1] + response[2:]
+
+    def pipeline(self, requests, depth=2):
+        """Sends a sequence of (method, path, payload) requests keeping up to
+        depth of them on the link and returns their responses in order. Depths
+        above one need a device with a full duplex Framer."""
+        responses = []
+        tokens = []
+        for method, path, payload in requests:
+            while len(tokens) >= depth:
+                responses.append(self.receive_pipelined(tokens.pop(0)))
+            if method != TPM_GET:
+                self.cache.pop(path, None)
+            self.send(method, self.token, path, payload is not None, payload)
+            tokens.append(self.token)
+            self.token = (self.token + 1) & 0x7F
+        while tokens:
+            responses.append(self.receive_pipelined(tokens.pop(0)))
+        return responses
+
+    def receive_pipelined(self, token):
+        response = self.receive()
+        if len(response) > 1 and response[1] != token:
+            raise PostmanError("Response token does not match request token.")
+        return response[0:1] + response[2:]